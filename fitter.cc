@@ -17,7 +17,9 @@
 // #define USE_EXACT_TRIANGLE_INTEGRAL
 
 #include <cmath>
+#include <memory>
 #include <stdexcept>
+#include <utility>
 
 #include <Eigen/Core>
 
@@ -26,8 +28,13 @@
 using namespace Eigen;
 using namespace Geometry;
 
+using Matrix10d = Matrix<double, 10, 10>;
+using Vector10d = Matrix<double, 10, 1>;
+
 namespace QuadricFitSolver {
   VectorXd solve(const MatrixXd &M, const MatrixXd &N, double tolerance);
+  void solve(size_t count, const Matrix10d *M, const Matrix10d *N, double tolerance,
+             Vector10d *results, int *ranks, bool *successes, size_t threads);
 }
 
 namespace {
@@ -43,6 +50,15 @@ struct Factorial<0> {
   static constexpr long long value = 1;
 };
 
+// Integer power (std::pow is slow for these)
+template <int N>
+double power(double x) {
+  if constexpr (N == 0)
+    return 1;
+  else
+    return x * power<N-1>(x);
+}
+
 // Compile-time binomial coefficient
 template <int N, int K>
 struct Binomial {
@@ -208,9 +224,9 @@ struct TermCalculator {
     const double term_coef = static_cast<double>(coef * num) / static_cast<double>(denom);
       
     double term = term_coef;
-    term *= std::pow(q[0][0], I) * std::pow(q[1][0], J) * std::pow(q[2][0], K);
-    term *= std::pow(q[0][1], L) * std::pow(q[1][1], S) * std::pow(q[2][1], T);
-    term *= std::pow(q[0][2], A) * std::pow(q[1][2], B) * std::pow(q[2][2], C);
+    term *= power<I>(q[0][0]) * power<J>(q[1][0]) * power<K>(q[2][0]);
+    term *= power<L>(q[0][1]) * power<S>(q[1][1]) * power<T>(q[2][1]);
+    term *= power<A>(q[0][2]) * power<B>(q[1][2]) * power<C>(q[2][2]);
       
     return term;
   }
@@ -262,119 +278,198 @@ double computeTriangleIntegral(const CoordType& q) {
 template <int M, int N, int P>
 double computeTriangleIntegral(const std::array<Point3D, 3> &q) {
   auto f = [](const Point3D &p) {
-    return std::pow(p[0], M) * std::pow(p[1], N) * std::pow(p[2], P);
+    return power<M>(p[0]) * power<N>(p[1]) * power<P>(p[2]);
   };
   return (f(q[0]) + f(q[1]) + f(q[2]) + f((q[0] + q[1] + q[2]) / 3)) / 4;
 }
 
 #endif  // USE_EXACT_TRIANGLE_INTEGRAL
 
+// Monomials x^i y^j z^k with i + j + k <= 4, in the order of Quadric::Moments
+constexpr auto exponents = [] {
+  std::array<std::array<int, 3>, 35> result;
+  size_t index = 0;
+  for (int d = 0; d <= 4; ++d)
+    for (int i = d; i >= 0; --i)
+      for (int j = d - i; j >= 0; --j)
+        result[index++] = { i, j, d - i - j };
+  return result;
+}();
+
+constexpr size_t monomialIndex(int i, int j, int k) {
+  size_t index = 0;
+  while (exponents[index] != std::array<int, 3>{ i, j, k })
+    ++index;
+  return index;
+}
+
+template <int I, int J, int K>
+double integral(const Quadric::Moments &moments) {
+  constexpr size_t index = monomialIndex(I, J, K);
+  return moments[index];
+}
+
+// M and N as in Yan'06, normalized by the area (the integral of 1)
+void assembleMatrices(const Quadric::Moments &moments, Matrix10d &M, Matrix10d &N) {
+  double A = moments[0];
+  M.setZero();
+  N.setZero();
+  M(0, 0) += integral<0,0,0>(moments);
+  M(1, 0) += integral<1,0,0>(moments);
+  M(1, 1) += integral<2,0,0>(moments);
+  M(2, 0) += integral<0,1,0>(moments);
+  M(2, 1) += integral<1,1,0>(moments);
+  M(2, 2) += integral<0,2,0>(moments);
+  M(3, 0) += integral<0,0,1>(moments);
+  M(3, 1) += integral<1,0,1>(moments);
+  M(3, 2) += integral<0,1,1>(moments);
+  M(3, 3) += integral<0,0,2>(moments);
+  M(4, 0) += integral<2,0,0>(moments);
+  M(4, 1) += integral<3,0,0>(moments);
+  M(4, 2) += integral<2,1,0>(moments);
+  M(4, 3) += integral<2,0,1>(moments);
+  M(4, 4) += integral<4,0,0>(moments);
+  M(5, 0) += integral<1,1,0>(moments);
+  M(5, 1) += integral<2,1,0>(moments);
+  M(5, 2) += integral<1,2,0>(moments);
+  M(5, 3) += integral<1,1,1>(moments);
+  M(5, 4) += integral<3,1,0>(moments);
+  M(5, 5) += integral<2,2,0>(moments);
+  M(6, 0) += integral<1,0,1>(moments);
+  M(6, 1) += integral<2,0,1>(moments);
+  M(6, 2) += integral<1,1,1>(moments);
+  M(6, 3) += integral<1,0,2>(moments);
+  M(6, 4) += integral<3,0,1>(moments);
+  M(6, 5) += integral<2,1,1>(moments);
+  M(6, 6) += integral<2,0,2>(moments);
+  M(7, 0) += integral<0,2,0>(moments);
+  M(7, 1) += integral<1,2,0>(moments);
+  M(7, 2) += integral<0,3,0>(moments);
+  M(7, 3) += integral<0,2,1>(moments);
+  M(7, 4) += integral<2,2,0>(moments);
+  M(7, 5) += integral<1,3,0>(moments);
+  M(7, 6) += integral<1,2,1>(moments);
+  M(7, 7) += integral<0,4,0>(moments);
+  M(8, 0) += integral<0,1,1>(moments);
+  M(8, 1) += integral<1,1,1>(moments);
+  M(8, 2) += integral<0,2,1>(moments);
+  M(8, 3) += integral<0,1,2>(moments);
+  M(8, 4) += integral<2,1,1>(moments);
+  M(8, 5) += integral<1,2,1>(moments);
+  M(8, 6) += integral<1,1,2>(moments);
+  M(8, 7) += integral<0,3,1>(moments);
+  M(8, 8) += integral<0,2,2>(moments);
+  M(9, 0) += integral<0,0,2>(moments);
+  M(9, 1) += integral<1,0,2>(moments);
+  M(9, 2) += integral<0,1,2>(moments);
+  M(9, 3) += integral<0,0,3>(moments);
+  M(9, 4) += integral<2,0,2>(moments);
+  M(9, 5) += integral<1,1,2>(moments);
+  M(9, 6) += integral<1,0,3>(moments);
+  M(9, 7) += integral<0,2,2>(moments);
+  M(9, 8) += integral<0,1,3>(moments);
+  M(9, 9) += integral<0,0,4>(moments);
+
+  N(1, 1) += integral<0,0,0>(moments);
+  N(2, 2) += integral<0,0,0>(moments);
+  N(3, 3) += integral<0,0,0>(moments);
+  N(4, 1) += integral<1,0,0>(moments) * 2;
+  N(4, 4) += integral<2,0,0>(moments) * 4;
+  N(5, 1) += integral<0,1,0>(moments);
+  N(5, 2) += integral<1,0,0>(moments);
+  N(5, 4) += integral<1,1,0>(moments) * 2;
+  N(5, 5) += integral<2,0,0>(moments);
+  N(5, 5) += integral<0,2,0>(moments);
+  N(6, 1) += integral<0,0,1>(moments);
+  N(6, 3) += integral<1,0,0>(moments);
+  N(6, 4) += integral<1,0,1>(moments) * 2;
+  N(6, 5) += integral<0,1,1>(moments);
+  N(6, 6) += integral<2,0,0>(moments);
+  N(6, 6) += integral<0,0,2>(moments);
+  N(7, 2) += integral<0,1,0>(moments) * 2;
+  N(7, 5) += integral<1,1,0>(moments) * 2;
+  N(7, 7) += integral<0,2,0>(moments) * 4;
+  N(8, 2) += integral<0,0,1>(moments);
+  N(8, 3) += integral<0,1,0>(moments);
+  N(8, 5) += integral<1,0,1>(moments);
+  N(8, 6) += integral<1,1,0>(moments);
+  N(8, 7) += integral<0,1,1>(moments) * 2;
+  N(8, 8) += integral<0,2,0>(moments);
+  N(8, 8) += integral<0,0,2>(moments);
+  N(9, 3) += integral<0,0,1>(moments) * 2;
+  N(9, 6) += integral<1,0,1>(moments) * 2;
+  N(9, 8) += integral<0,1,1>(moments) * 2;
+  N(9, 9) += integral<0,0,2>(moments) * 4;
+
+  M /= A;
+  N /= A;
+  M = M.selfadjointView<Lower>();
+  N = N.selfadjointView<Lower>();
+}
+
+template <size_t... Is>
+void addIntegrals(const std::array<Point3D, 3> &triangle, double area, Quadric::Moments &moments,
+                  std::index_sequence<Is...>) {
+  ((moments[Is] += area * computeTriangleIntegral<exponents[Is][0],
+                                                  exponents[Is][1],
+                                                  exponents[Is][2]>(triangle)), ...);
+}
+
+}
+
+namespace QuadricFitter {
+
+void addTriangleMoments(const std::array<Point3D, 3> &triangle, Quadric::Moments &moments) {
+  addIntegrals(triangle, triangleArea(triangle), moments, std::make_index_sequence<35>());
+}
+
 }
 
 void Quadric::fit(const TriMesh &mesh, double tolerance) {
-  MatrixXd M = MatrixXd::Zero(10, 10);
-  MatrixXd N = MatrixXd::Zero(10, 10);
+  Moments moments = {};
   std::array<Point3D, 3> triangle;
-  double A = 0;
   for (const auto &tri : mesh.triangles()) {
     for (size_t i = 0; i < 3; ++i)
       triangle[i] = mesh[tri[i]];
-    auto area = triangleArea(triangle);
-    A += area;
-    
-    M(0, 0) += area * computeTriangleIntegral<0,0,0>(triangle);
-    M(1, 0) += area * computeTriangleIntegral<1,0,0>(triangle);
-    M(1, 1) += area * computeTriangleIntegral<2,0,0>(triangle);
-    M(2, 0) += area * computeTriangleIntegral<0,1,0>(triangle);
-    M(2, 1) += area * computeTriangleIntegral<1,1,0>(triangle);
-    M(2, 2) += area * computeTriangleIntegral<0,2,0>(triangle);
-    M(3, 0) += area * computeTriangleIntegral<0,0,1>(triangle);
-    M(3, 1) += area * computeTriangleIntegral<1,0,1>(triangle);
-    M(3, 2) += area * computeTriangleIntegral<0,1,1>(triangle);
-    M(3, 3) += area * computeTriangleIntegral<0,0,2>(triangle);
-    M(4, 0) += area * computeTriangleIntegral<2,0,0>(triangle);
-    M(4, 1) += area * computeTriangleIntegral<3,0,0>(triangle);
-    M(4, 2) += area * computeTriangleIntegral<2,1,0>(triangle);
-    M(4, 3) += area * computeTriangleIntegral<2,0,1>(triangle);
-    M(4, 4) += area * computeTriangleIntegral<4,0,0>(triangle);
-    M(5, 0) += area * computeTriangleIntegral<1,1,0>(triangle);
-    M(5, 1) += area * computeTriangleIntegral<2,1,0>(triangle);
-    M(5, 2) += area * computeTriangleIntegral<1,2,0>(triangle);
-    M(5, 3) += area * computeTriangleIntegral<1,1,1>(triangle);
-    M(5, 4) += area * computeTriangleIntegral<3,1,0>(triangle);
-    M(5, 5) += area * computeTriangleIntegral<2,2,0>(triangle);
-    M(6, 0) += area * computeTriangleIntegral<1,0,1>(triangle);
-    M(6, 1) += area * computeTriangleIntegral<2,0,1>(triangle);
-    M(6, 2) += area * computeTriangleIntegral<1,1,1>(triangle);
-    M(6, 3) += area * computeTriangleIntegral<1,0,2>(triangle);
-    M(6, 4) += area * computeTriangleIntegral<3,0,1>(triangle);
-    M(6, 5) += area * computeTriangleIntegral<2,1,1>(triangle);
-    M(6, 6) += area * computeTriangleIntegral<2,0,2>(triangle);
-    M(7, 0) += area * computeTriangleIntegral<0,2,0>(triangle);
-    M(7, 1) += area * computeTriangleIntegral<1,2,0>(triangle);
-    M(7, 2) += area * computeTriangleIntegral<0,3,0>(triangle);
-    M(7, 3) += area * computeTriangleIntegral<0,2,1>(triangle);
-    M(7, 4) += area * computeTriangleIntegral<2,2,0>(triangle);
-    M(7, 5) += area * computeTriangleIntegral<1,3,0>(triangle);
-    M(7, 6) += area * computeTriangleIntegral<1,2,1>(triangle);
-    M(7, 7) += area * computeTriangleIntegral<0,4,0>(triangle);
-    M(8, 0) += area * computeTriangleIntegral<0,1,1>(triangle);
-    M(8, 1) += area * computeTriangleIntegral<1,1,1>(triangle);
-    M(8, 2) += area * computeTriangleIntegral<0,2,1>(triangle);
-    M(8, 3) += area * computeTriangleIntegral<0,1,2>(triangle);
-    M(8, 4) += area * computeTriangleIntegral<2,1,1>(triangle);
-    M(8, 5) += area * computeTriangleIntegral<1,2,1>(triangle);
-    M(8, 6) += area * computeTriangleIntegral<1,1,2>(triangle);
-    M(8, 7) += area * computeTriangleIntegral<0,3,1>(triangle);
-    M(8, 8) += area * computeTriangleIntegral<0,2,2>(triangle);
-    M(9, 0) += area * computeTriangleIntegral<0,0,2>(triangle);
-    M(9, 1) += area * computeTriangleIntegral<1,0,2>(triangle);
-    M(9, 2) += area * computeTriangleIntegral<0,1,2>(triangle);
-    M(9, 3) += area * computeTriangleIntegral<0,0,3>(triangle);
-    M(9, 4) += area * computeTriangleIntegral<2,0,2>(triangle);
-    M(9, 5) += area * computeTriangleIntegral<1,1,2>(triangle);
-    M(9, 6) += area * computeTriangleIntegral<1,0,3>(triangle);
-    M(9, 7) += area * computeTriangleIntegral<0,2,2>(triangle);
-    M(9, 8) += area * computeTriangleIntegral<0,1,3>(triangle);
-    M(9, 9) += area * computeTriangleIntegral<0,0,4>(triangle);
-
-    N(1, 1) += area * computeTriangleIntegral<0,0,0>(triangle);
-    N(2, 2) += area * computeTriangleIntegral<0,0,0>(triangle);
-    N(3, 3) += area * computeTriangleIntegral<0,0,0>(triangle);
-    N(4, 1) += area * computeTriangleIntegral<1,0,0>(triangle) * 2;
-    N(4, 4) += area * computeTriangleIntegral<2,0,0>(triangle) * 4;
-    N(5, 1) += area * computeTriangleIntegral<0,1,0>(triangle);
-    N(5, 2) += area * computeTriangleIntegral<1,0,0>(triangle);
-    N(5, 4) += area * computeTriangleIntegral<1,1,0>(triangle) * 2;
-    N(5, 5) += area * computeTriangleIntegral<2,0,0>(triangle);
-    N(5, 5) += area * computeTriangleIntegral<0,2,0>(triangle);
-    N(6, 1) += area * computeTriangleIntegral<0,0,1>(triangle);
-    N(6, 3) += area * computeTriangleIntegral<1,0,0>(triangle);
-    N(6, 4) += area * computeTriangleIntegral<1,0,1>(triangle) * 2;
-    N(6, 5) += area * computeTriangleIntegral<0,1,1>(triangle);
-    N(6, 6) += area * computeTriangleIntegral<2,0,0>(triangle);
-    N(6, 6) += area * computeTriangleIntegral<0,0,2>(triangle);
-    N(7, 2) += area * computeTriangleIntegral<0,1,0>(triangle) * 2;
-    N(7, 5) += area * computeTriangleIntegral<1,1,0>(triangle) * 2;
-    N(7, 7) += area * computeTriangleIntegral<0,2,0>(triangle) * 4;
-    N(8, 2) += area * computeTriangleIntegral<0,0,1>(triangle);
-    N(8, 3) += area * computeTriangleIntegral<0,1,0>(triangle);
-    N(8, 5) += area * computeTriangleIntegral<1,0,1>(triangle);
-    N(8, 6) += area * computeTriangleIntegral<1,1,0>(triangle);
-    N(8, 7) += area * computeTriangleIntegral<0,1,1>(triangle) * 2;
-    N(8, 8) += area * computeTriangleIntegral<0,2,0>(triangle);
-    N(8, 8) += area * computeTriangleIntegral<0,0,2>(triangle);
-    N(9, 3) += area * computeTriangleIntegral<0,0,1>(triangle) * 2;
-    N(9, 6) += area * computeTriangleIntegral<1,0,1>(triangle) * 2;
-    N(9, 8) += area * computeTriangleIntegral<0,1,1>(triangle) * 2;
-    N(9, 9) += area * computeTriangleIntegral<0,0,2>(triangle) * 4;
+    QuadricFitter::addTriangleMoments(triangle, moments);
   }
+  fit(moments, tolerance);
+}
 
-  M /= A;
-  N /= A;
-  M = M.selfadjointView<Lower>();
-  N = N.selfadjointView<Lower>();
-
+void Quadric::fit(const Moments &moments, double tolerance) {
+  if (moments[0] <= 0)
+    throw std::runtime_error("Nothing to fit on (zero area)");
+  Matrix10d M, N;
+  assembleMatrices(moments, M, N);
   auto s = QuadricFitSolver::solve(M, N, tolerance);
   std::copy(s.begin(), s.end(), coeffs.begin());
 }
+
+std::vector<BatchFit> fitBatch(const std::vector<Quadric::Moments> &moments,
+                               double tolerance, size_t threads) {
+  // Problems with zero area are not solved at all
+  std::vector<size_t> valid;
+  for (size_t i = 0; i < moments.size(); ++i)
+    if (moments[i][0] > 0)
+      valid.push_back(i);
+
+  size_t n = valid.size();
+  std::vector<Matrix10d> M(n), N(n);
+  for (size_t i = 0; i < n; ++i)
+    assembleMatrices(moments[valid[i]], M[i], N[i]);
+
+  std::vector<Vector10d> solutions(n);
+  std::vector<int> ranks(n);
+  auto successes = std::make_unique<bool[]>(n);
+  QuadricFitSolver::solve(n, M.data(), N.data(), tolerance,
+                          solutions.data(), ranks.data(), successes.get(), threads);
+
+  std::vector<BatchFit> result(moments.size(), { Quadric{}, 0, false });
+  for (size_t i = 0; i < n; ++i) {
+    auto &r = result[valid[i]];
+    std::copy(solutions[i].begin(), solutions[i].end(), r.quadric.coeffs.begin());
+    r.rank = ranks[i];
+    r.success = successes[i];
+  }
+  return result;
+}
@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cstdint>
+
+#include "quadric-fit.hh"
+
+using namespace Geometry;
+
+namespace QuadricFitter {
+  void addTriangleMoments(const std::array<Point3D, 3> &triangle, Quadric::Moments &moments);
+}
+
+namespace {
+
+// Spreads the lower 21 bits of x to every third bit
+uint64_t spreadBits(uint64_t x) {
+  x &= 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffff;
+  x = (x | x << 16) & 0x1f0000ff0000ff;
+  x = (x | x << 8)  & 0x100f00f00f00f00f;
+  x = (x | x << 4)  & 0x10c30c30c30c30c3;
+  x = (x | x << 2)  & 0x1249249249249249;
+  return x;
+}
+
+Point3D centroid(const TriMesh &mesh, size_t index) {
+  const auto &tri = mesh.triangles()[index];
+  return (mesh[tri[0]] + mesh[tri[1]] + mesh[tri[2]]) / 3;
+}
+
+// Number of nodes built over n triangles (follows MomentTree::build)
+size_t nodeCount(size_t n, size_t leaf_size) {
+  if (n <= leaf_size)
+    return 1;
+  return 1 + nodeCount(n / 2, leaf_size) + nodeCount(n - n / 2, leaf_size);
+}
+
+void addMoments(Quadric::Moments &moments, const Quadric::Moments &other) {
+  for (size_t i = 0; i < moments.size(); ++i)
+    moments[i] += other[i];
+}
+
+}
+
+MomentTree::MomentTree(const TriMesh &mesh, size_t leaf_size) : mesh(mesh) {
+  size_t n = mesh.triangles().size();
+  if (n == 0)
+    return;
+
+  PointVector centroids(n);
+  Point3D min, max;
+  for (size_t i = 0; i < n; ++i) {
+    centroids[i] = centroid(mesh, i);
+    for (size_t j = 0; j < 3; ++j) {
+      if (i == 0 || centroids[i][j] < min[j])
+        min[j] = centroids[i][j];
+      if (i == 0 || centroids[i][j] > max[j])
+        max[j] = centroids[i][j];
+    }
+  }
+
+  std::vector<std::pair<uint64_t, size_t>> codes(n);
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t code = 0;
+    for (size_t j = 0; j < 3; ++j) {
+      double extent = max[j] - min[j];
+      double u = extent > 0 ? (centroids[i][j] - min[j]) / extent : 0;
+      code |= spreadBits(static_cast<uint64_t>(u * 0x1fffff)) << j;
+    }
+    codes[i] = { code, i };
+  }
+  std::sort(codes.begin(), codes.end());
+  order.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    order[i] = codes[i].second;
+
+  leaf_size = std::max<size_t>(leaf_size, 1);
+  nodes.reserve(nodeCount(n, leaf_size));
+  build(0, n, leaf_size);
+}
+
+// Builds the subtree over order[begin..end) by halving the Morton order;
+// returns the index of its root
+size_t MomentTree::build(size_t begin, size_t end, size_t leaf_size) {
+  size_t index = nodes.size();
+  nodes.emplace_back();
+  Node node { {}, {}, begin, end, 0, {} };
+
+  if (end - begin <= leaf_size) {
+    for (size_t i = begin; i < end; ++i) {
+      auto c = centroid(mesh, order[i]);
+      for (size_t j = 0; j < 3; ++j) {
+        if (i == begin || c[j] < node.min[j])
+          node.min[j] = c[j];
+        if (i == begin || c[j] > node.max[j])
+          node.max[j] = c[j];
+      }
+      addTriangle(order[i], node.moments);
+    }
+  } else {
+    size_t mid = (begin + end) / 2;
+    size_t left = build(begin, mid, leaf_size);
+    node.right = build(mid, end, leaf_size);
+    const auto &l = nodes[left], &r = nodes[node.right];
+    for (size_t j = 0; j < 3; ++j) {
+      node.min[j] = std::min(l.min[j], r.min[j]);
+      node.max[j] = std::max(l.max[j], r.max[j]);
+    }
+    node.moments = l.moments;
+    addMoments(node.moments, r.moments);
+  }
+
+  nodes[index] = node;
+  return index;
+}
+
+void MomentTree::addTriangle(size_t index, Quadric::Moments &moments) const {
+  const auto &tri = mesh.triangles()[index];
+  QuadricFitter::addTriangleMoments({ mesh[tri[0]], mesh[tri[1]], mesh[tri[2]] }, moments);
+}
+
+Quadric::Moments MomentTree::moments(const Point3D &min, const Point3D &max) const {
+  auto box_test = [&](const Point3D &bmin, const Point3D &bmax) {
+    bool inside = true;
+    for (size_t j = 0; j < 3; ++j) {
+      if (bmax[j] < min[j] || bmin[j] > max[j])
+        return OUTSIDE;
+      if (bmin[j] < min[j] || bmax[j] > max[j])
+        inside = false;
+    }
+    return inside ? INSIDE : PARTIAL;
+  };
+  auto triangle_test = [&](size_t index) {
+    auto c = centroid(mesh, index);
+    for (size_t j = 0; j < 3; ++j)
+      if (c[j] < min[j] || c[j] > max[j])
+        return false;
+    return true;
+  };
+  return moments(box_test, triangle_test);
+}
+
+Quadric::Moments MomentTree::moments(const BoxTest &box_test,
+                                     const TriangleTest &triangle_test) const {
+  Quadric::Moments result = {};
+  if (nodes.empty())
+    return result;
+
+  std::vector<size_t> stack = { 0 };
+  while (!stack.empty()) {
+    size_t index = stack.back();
+    stack.pop_back();
+    const auto &node = nodes[index];
+    switch (box_test(node.min, node.max)) {
+    case OUTSIDE: break;
+    case INSIDE: addMoments(result, node.moments); break;
+    case PARTIAL:
+      if (node.right == 0) {
+        for (size_t i = node.begin; i < node.end; ++i)
+          if (triangle_test(order[i]))
+            addTriangle(order[i], result);
+      } else {
+        stack.push_back(index + 1);
+        stack.push_back(node.right);
+      }
+    }
+  }
+  return result;
+}
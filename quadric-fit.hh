@@ -1,5 +1,9 @@
 #pragma once
 
+#include <functional>
+#include <limits>
+#include <optional>
+
 #include <geometry.hh>          // https://github.com/salvipeter/libgeom/
 
 // Fitting & distance computation is based on:
@@ -26,12 +30,48 @@ struct Quadric {
   double eval(const Geometry::Point3D &p) const;
   Geometry::Vector3D grad(const Geometry::Point3D &p) const;
 
+  // Evaluation on the regular grid origin + (i * spacing[0], j * spacing[1], k * spacing[2]),
+  // 0 <= i < size[0], 0 <= j < size[1], 0 <= k < size[2], stored at [(k * size[1] + j) * size[0] + i].
+  // Uses forward differencing (two additions per node); gradients are also computed if requested.
+  std::vector<double> evalGrid(const Geometry::Point3D &origin, const Geometry::Vector3D &spacing,
+                               const std::array<size_t, 3> &size,
+                               std::vector<Geometry::Vector3D> *gradients = nullptr) const;
+
   // Approximation of the Euclidean distance (Taubin's second-order formula)
   double distance(const Geometry::Point3D &p) const;
 
+  // Ray casting: the first intersection of o + t d with t in [tmin, tmax],
+  // optionally clipped to the axis-aligned box [box->first, box->second].
+  // Returns infinity when there is no hit.
+  double intersect(const Geometry::Point3D &o, const Geometry::Vector3D &d,
+                   double tmin = 0, double tmax = std::numeric_limits<double>::infinity(),
+                   const std::optional<std::pair<Geometry::Point3D, Geometry::Point3D>> &box = {}) const;
+
+  // Ray packet in SoA layout (so that the batched version is vectorized by the compiler)
+  struct Rays {
+    std::vector<double> ox, oy, oz, dx, dy, dz;
+    size_t size() const { return ox.size(); }
+    void resize(size_t n);
+  };
+  // Hits in the same layout (t is infinity and the normal is zero for missing rays);
+  // normals are the normalized gradients at the hit points
+  struct Hits {
+    std::vector<double> t, nx, ny, nz;
+  };
+  Hits intersect(const Rays &rays, double tmin = 0,
+                 double tmax = std::numeric_limits<double>::infinity(),
+                 const std::optional<std::pair<Geometry::Point3D, Geometry::Point3D>> &box = {}) const;
+
   // Fitter (eigenvalues <= tolerance are treated as zero)
   void fit(const Geometry::TriMesh &mesh, double tolerance = 1e-8);
 
+  // Area-weighted integrals of x^i y^j z^k for i + j + k <= 4 over a surface,
+  // ordered by degree, then by decreasing i, then by decreasing j:
+  //   1, x, y, z, x^2, xy, xz, y^2, yz, z^2, x^3, x^2y, ...
+  // These are additive, so the moments of disjoint surfaces can be summed before fitting.
+  using Moments = std::array<double, 35>;
+  void fit(const Moments &moments, double tolerance = 1e-8);
+
   // Classification (eigenvalues <= tolerance are treated as zero)
   enum Type {
     NO_SURFACE = 0, PLANE, TWO_PLANES,
@@ -41,3 +81,68 @@ struct Quadric {
   };
   Type classify(double tolerance = 1e-8) const;
 };
+
+// Quadric sampled on a cubic grid with 2^level cells along each axis, covering the box
+// [center - radius, center + radius], usable as an implicit function; points not on the grid
+// are evaluated directly. As the whole grid is sampled up front, this only pays off when
+// most nodes are visited (e.g. uniform extraction), not for adaptive ones.
+class QuadricGrid {
+public:
+  QuadricGrid(const Quadric &quadric, const Geometry::Point3D &center, double radius, size_t level);
+  double operator()(const Geometry::Point3D &p) const;
+
+private:
+  Quadric quadric;
+  Geometry::Point3D origin;
+  double spacing, inv_spacing;
+  size_t size;
+  std::vector<double> values;
+};
+
+// Batched fitter for many independent problems (e.g. the regions of a segmentation),
+// split among the given number of threads (0 means all hardware threads).
+// The threads are created anew on each call, so it is better to collect many
+// problems (e.g. all regions of a VSA iteration) into one call than to make several.
+// Instead of throwing, failures are reported for each problem.
+struct BatchFit {
+  Quadric quadric;
+  int rank;                     // rank of N (number of eigenvalues > tolerance)
+  bool success;
+};
+std::vector<BatchFit> fitBatch(const std::vector<Quadric::Moments> &moments,
+                               double tolerance = 1e-8, size_t threads = 0);
+
+// Bounding volume hierarchy over the triangle centroids of a mesh (in Morton order),
+// storing the summed moments of each node. Fitting on a region of the mesh then needs
+// only the moments of O(log n) nodes and of the triangles on the region boundary.
+// The mesh is not copied, so it should outlive the tree.
+class MomentTree {
+public:
+  MomentTree(const Geometry::TriMesh &mesh, size_t leaf_size = 32);
+
+  // Moments of the triangles with their centroids in the box [min, max]
+  Quadric::Moments moments(const Geometry::Point3D &min, const Geometry::Point3D &max) const;
+
+  // Moments of an arbitrary region (e.g. a lasso selection), given by
+  // - a test telling whether the centroids in the box [min, max] are all inside the region,
+  //   all outside, or it cannot tell, and
+  // - a test telling whether a triangle (given by its index in the mesh) is inside
+  enum Overlap { OUTSIDE, PARTIAL, INSIDE };
+  using BoxTest = std::function<Overlap(const Geometry::Point3D &, const Geometry::Point3D &)>;
+  using TriangleTest = std::function<bool(size_t)>;
+  Quadric::Moments moments(const BoxTest &box_test, const TriangleTest &triangle_test) const;
+
+private:
+  struct Node {
+    Geometry::Point3D min, max; // bounding box of the centroids
+    size_t begin, end;          // range in `order`
+    size_t right;               // the left child follows its parent; 0 for leaves
+    Quadric::Moments moments;
+  };
+  size_t build(size_t begin, size_t end, size_t leaf_size);
+  void addTriangle(size_t index, Quadric::Moments &moments) const;
+
+  const Geometry::TriMesh &mesh;
+  std::vector<size_t> order;    // triangle indices in Morton order
+  std::vector<Node> nodes;
+};
@@ -0,0 +1,129 @@
+// Ray-quadric intersection
+//
+// Substituting p = o + t d into p^T Q p + P^T p + R = 0 gives a t^2 + b t + c = 0 with
+//   a = d^T Q d,   b = 2 o^T Q d + P^T d,   c = f(o).
+// The roots are computed in the numerically stable form q = -(b + sgn(b) sqrt(D)) / 2,
+//   t1 = q / a,   t2 = c / q,
+// which also handles the degenerate (a = 0) case, as t1 becomes infinite and is discarded.
+//
+// The kernel below has no early exits (NaNs from negative discriminants just fail
+// the range tests), so the batched loops over SoA data are vectorized by the compiler
+// (this needs -fno-math-errno, otherwise std::sqrt has a branch for setting errno).
+
+#include <algorithm>
+#include <cmath>
+
+#include "quadric-fit.hh"
+
+using namespace Geometry;
+
+namespace {
+
+constexpr double inf = std::numeric_limits<double>::infinity();
+
+// Restricts [lo, hi] to the parameter interval inside the box (slab test)
+inline void clipToBox(const std::pair<Point3D, Point3D> &box,
+                      double ox, double oy, double oz, double dx, double dy, double dz,
+                      double &lo, double &hi) {
+  const double o[] = { ox, oy, oz }, d[] = { dx, dy, dz };
+  for (size_t i = 0; i < 3; ++i) {
+    double t0 = (box.first[i] - o[i]) / d[i];
+    double t1 = (box.second[i] - o[i]) / d[i];
+    lo = std::max(lo, std::min(t0, t1));
+    hi = std::min(hi, std::max(t0, t1));
+  }
+}
+
+inline double firstHit(const std::array<double, 10> &c,
+                       double ox, double oy, double oz, double dx, double dy, double dz,
+                       double lo, double hi) {
+  double qx = c[4] * dx + c[5] / 2 * dy + c[6] / 2 * dz;
+  double qy = c[5] / 2 * dx + c[7] * dy + c[8] / 2 * dz;
+  double qz = c[6] / 2 * dx + c[8] / 2 * dy + c[9] * dz;
+  double A = dx * qx + dy * qy + dz * qz;
+  double B = 2 * (ox * qx + oy * qy + oz * qz) + c[1] * dx + c[2] * dy + c[3] * dz;
+  double C =
+    c[0] +
+    c[1] * ox + c[2] * oy + c[3] * oz +
+    c[4] * ox * ox + c[5] * ox * oy + c[6] * ox * oz +
+    c[7] * oy * oy + c[8] * oy * oz + c[9] * oz * oz;
+  double q = -(B + std::copysign(std::sqrt(B * B - 4 * A * C), B)) / 2;
+  double t1 = q / A, t2 = C / q;
+  // Infinite roots (A = 0 or q = 0) are not hits; NaNs fail all range tests
+  t1 = std::abs(t1) < inf ? t1 : std::numeric_limits<double>::quiet_NaN();
+  t2 = std::abs(t2) < inf ? t2 : std::numeric_limits<double>::quiet_NaN();
+  double near = t1 < t2 ? t1 : t2, far = t1 < t2 ? t2 : t1;
+  return near >= lo && near <= hi ? near : (far >= lo && far <= hi ? far : inf);
+}
+
+// Batched kernels; the outputs are declared __restrict, otherwise the number of
+// runtime alias checks would be too much for the vectorizer.
+
+void castRays(const std::array<double, 10> &c, size_t n,
+              const double *ox, const double *oy, const double *oz,
+              const double *dx, const double *dy, const double *dz,
+              double tmin, double tmax, const std::optional<std::pair<Point3D, Point3D>> &box,
+              double *__restrict t) {
+  // Separate loops, so that the common unclipped case has no loop-invariant branch
+  if (box)
+    for (size_t i = 0; i < n; ++i) {
+      double lo = tmin, hi = tmax;
+      clipToBox(*box, ox[i], oy[i], oz[i], dx[i], dy[i], dz[i], lo, hi);
+      t[i] = firstHit(c, ox[i], oy[i], oz[i], dx[i], dy[i], dz[i], lo, hi);
+    }
+  else
+    for (size_t i = 0; i < n; ++i)
+      t[i] = firstHit(c, ox[i], oy[i], oz[i], dx[i], dy[i], dz[i], tmin, tmax);
+}
+
+// Normalized gradients (see Quadric::grad) at the hit points, zero for missing rays
+void hitNormals(const std::array<double, 10> &c, size_t n,
+                const double *ox, const double *oy, const double *oz,
+                const double *dx, const double *dy, const double *dz, const double *t,
+                double *__restrict nx, double *__restrict ny, double *__restrict nz) {
+  for (size_t i = 0; i < n; ++i) {
+    double ti = t[i] < inf ? t[i] : 0;
+    double px = ox[i] + ti * dx[i], py = oy[i] + ti * dy[i], pz = oz[i] + ti * dz[i];
+    double gx = c[1] + c[4] * 2 * px + c[5] * py + c[6] * pz;
+    double gy = c[2] + c[5] * px + c[7] * 2 * py + c[8] * pz;
+    double gz = c[3] + c[6] * px + c[8] * py + c[9] * 2 * pz;
+    // Zero gradients (singular points) also give zero normals, as 0 * max = 0
+    double inv = std::min(1 / std::sqrt(gx * gx + gy * gy + gz * gz), std::numeric_limits<double>::max());
+    double s = t[i] < inf ? inv : 0;
+    nx[i] = gx * s;
+    ny[i] = gy * s;
+    nz[i] = gz * s;
+  }
+}
+
+}
+
+void Quadric::Rays::resize(size_t n) {
+  for (auto v : { &ox, &oy, &oz, &dx, &dy, &dz })
+    v->resize(n);
+}
+
+double Quadric::intersect(const Point3D &o, const Vector3D &d, double tmin, double tmax,
+                          const std::optional<std::pair<Point3D, Point3D>> &box) const {
+  if (box)
+    clipToBox(*box, o[0], o[1], o[2], d[0], d[1], d[2], tmin, tmax);
+  if (tmin > tmax)
+    return inf;
+  return firstHit(coeffs, o[0], o[1], o[2], d[0], d[1], d[2], tmin, tmax);
+}
+
+Quadric::Hits Quadric::intersect(const Rays &rays, double tmin, double tmax,
+                                 const std::optional<std::pair<Point3D, Point3D>> &box) const {
+  size_t n = rays.size();
+  Hits hits;
+  hits.t.resize(n);
+  hits.nx.resize(n);
+  hits.ny.resize(n);
+  hits.nz.resize(n);
+  castRays(coeffs, n, rays.ox.data(), rays.oy.data(), rays.oz.data(),
+           rays.dx.data(), rays.dy.data(), rays.dz.data(), tmin, tmax, box, hits.t.data());
+  hitNormals(coeffs, n, rays.ox.data(), rays.oy.data(), rays.oz.data(),
+             rays.dx.data(), rays.dy.data(), rays.dz.data(), hits.t.data(),
+             hits.nx.data(), hits.ny.data(), hits.nz.data());
+  return hits;
+}
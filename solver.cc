@@ -2,13 +2,23 @@
 
 // As in Appendix B of Taubin '91
 
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
 #include <Eigen/Dense>
 
 using namespace Eigen;
 
 namespace QuadricFitSolver {
 
-static std::pair<MatrixXd, MatrixXd> choleskyWithFullPivoting(const MatrixXd& N, double tolerance) {
+// All matrices are at most 10x10, so they can live on the stack
+using Mat = Matrix<double, Dynamic, Dynamic, 0, 10, 10>;
+using Matrix10d = Matrix<double, 10, 10>;
+using Vector10d = Matrix<double, 10, 1>;
+
+static std::pair<Mat, Mat> choleskyWithFullPivoting(const Mat& N, double tolerance) {
   // Ensure N is symmetric positive semidefinite
   if (N.rows() != N.cols()) {
     throw std::invalid_argument("Matrix N must be square.");
@@ -17,30 +27,30 @@ static std::pair<MatrixXd, MatrixXd> choleskyWithFullPivoting(const MatrixXd& N,
   const int r = N.rows();
 
   // Perform LDLT decomposition (supports positive semidefinite matrices)
-  LDLT<MatrixXd> ldlt(N);
+  LDLT<Mat> ldlt(N);
 
   if (ldlt.info() != Success) {
     throw std::invalid_argument("LDLT decomposition failed. Ensure N is positive semidefinite.");
   }
 
   // Extract rank of N from the diagonal of D
-  VectorXd D = ldlt.vectorD();
+  const auto &D = ldlt.vectorD();
   int rank = (D.array().abs() > tolerance).count();
 
   // Extract L (lower triangular part)
-  MatrixXd L = ldlt.matrixL();
+  Mat L = ldlt.matrixL();
 
   // Compute L1: L scaled by sqrt(D) for positive diagonal entries, limited to rank columns
-  MatrixXd L1 = L.leftCols(rank) * D.head(rank).cwiseSqrt().asDiagonal();
+  Mat L1 = L.leftCols(rank) * D.head(rank).cwiseSqrt().asDiagonal();
 
   // Compute L2: Orthogonal complement to L1
-  MatrixXd L2 = MatrixXd::Identity(r, r).rightCols(r - rank);
+  Mat L2 = Mat::Identity(r, r).rightCols(r - rank);
 
   return {L1, L2};
 }
 
 // Function to extract H1, H2, H3 from the matrix H
-static void extractBlocks(const MatrixXd& H, MatrixXd& H1, MatrixXd& H2, MatrixXd& H3, int h) {
+static void extractBlocks(const Mat& H, Mat& H1, Mat& H2, Mat& H3, int h) {
   int r = H.rows();
   if (H.cols() != r) {
     throw std::invalid_argument("Matrix H must be square.");
@@ -54,7 +64,7 @@ static void extractBlocks(const MatrixXd& H, MatrixXd& H1, MatrixXd& H2, MatrixX
   // Extract the blocks from H
   H1 = H.bottomRightCorner(r_h, r_h);
   if (H1.determinant() == 0) {
-    H2 = MatrixXd::Zero(h, r_h);
+    H2 = Mat::Zero(h, r_h);
     H3 = H.topLeftCorner(h, h);
   } else {
     H2 = H.topRightCorner(h, r_h) * H1.inverse();
@@ -62,26 +72,71 @@ static void extractBlocks(const MatrixXd& H, MatrixXd& H1, MatrixXd& H2, MatrixX
   }
 }
 
-VectorXd solve(const MatrixXd &M, const MatrixXd &N, double tolerance) {
+static Vector10d solveFixed(const Matrix10d &M, const Matrix10d &N, double tolerance, int &rank) {
   auto [L1, L2] = choleskyWithFullPivoting(N, tolerance);
   int r = 10, h = L1.cols(), k = 1;
-  MatrixXd L(r, r);
+  rank = h;
+  Matrix10d L;
   L.leftCols(h) = L1;
   L.rightCols(r - h) = L2;
-  auto Linv = L.inverse();
-  auto H = Linv * M * Linv.transpose();
-  MatrixXd H1, H2, H3;
+  Matrix10d Linv = L.inverse();
+  Matrix10d H = Linv * M * Linv.transpose();
+  Mat H1, H2, H3;
   extractBlocks(H, H1, H2, H3, h);
-  SelfAdjointEigenSolver<MatrixXd> solver(H3);
+  SelfAdjointEigenSolver<Mat> solver(H3);
   if (solver.info() != Success)
     throw std::runtime_error("Reduced generalized eigenproblem failed");
-  MatrixXd U1 = solver.eigenvectors().col(0).transpose();
-  MatrixXd U2 = -U1 * H2;
-  MatrixXd U(k, r);
+  Mat U1 = solver.eigenvectors().col(0).transpose();
+  Mat U2 = -U1 * H2;
+  Mat U(k, r);
   U.leftCols(h) = U1;
   U.rightCols(r - h) = U2;
-  MatrixXd F = U * Linv;
+  Mat F = U * Linv;
   return F.row(0);
 }
 
+VectorXd solve(const MatrixXd &M, const MatrixXd &N, double tolerance) {
+  if (M.rows() != 10 || M.cols() != 10 || N.rows() != 10 || N.cols() != 10)
+    throw std::invalid_argument("Matrices M and N must be 10x10.");
+  int rank;
+  return solveFixed(M, N, tolerance, rank);
+}
+
+// Problems are solved independently, but split among multiple threads;
+// failures are reported instead of throwing
+void solve(size_t count, const Matrix10d *M, const Matrix10d *N, double tolerance,
+           Vector10d *results, int *ranks, bool *successes, size_t threads) {
+  if (threads == 0)
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  threads = std::min(threads, count);
+  auto work = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      ranks[i] = 0;
+      try {
+        results[i] = solveFixed(M[i], N[i], tolerance, ranks[i]);
+        successes[i] = results[i].allFinite();
+      } catch (const std::exception &) {
+        successes[i] = false;
+      }
+      if (!successes[i])
+        results[i].setZero();
+    }
+  };
+  // If a thread cannot be created, its range (and all later ones) are done here;
+  // the pool is reserved up front, so only the thread constructor can throw
+  std::vector<std::thread> pool;
+  if (threads > 1)
+    pool.reserve(threads - 1);
+  size_t t = 1;
+  try {
+    for (; t < threads; ++t)
+      pool.emplace_back(work, count * t / threads, count * (t + 1) / threads);
+  } catch (const std::system_error &) {
+    work(count * t / threads, count);
+  }
+  work(0, count / std::max<size_t>(threads, 1));
+  for (auto &thread : pool)
+    thread.join();
+}
+
 }